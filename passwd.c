@@ -23,6 +23,9 @@ static const char rcsid[] = "$Id: passwd.c,v 1.15 2002-10-22 21:41:03 ghudson Ex
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <sys/mman.h>
+#include <dirent.h>
+#include <time.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -31,51 +34,172 @@ static const char rcsid[] = "$Id: passwd.c,v 1.15 2002-10-22 21:41:03 ghudson Ex
 #include <errno.h>
 #include <pwd.h>
 #include <signal.h>
+#include <syslog.h>
 #include <al.h>
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#else
+/* Without static tracepoint support, probes compile to nothing. */
+#define DTRACE_PROBE1(provider, name, arg1)
+#define DTRACE_PROBE2(provider, name, arg1, arg2)
+#endif
 
 #define PATH_KPASSWD_PROG	"/usr/athena/bin/kpasswd"
 #define PATH_PASSWD_PROG	"/usr/bin/passwd"
 
-/* This is a little non-intuitive.  PATH_PASSWD gives the pathname of
+/* Local passwd files larger than this are copied only while holding
+ * the lock, so that concurrent updaters don't each write a copy.
+ */
+#define MAX_UNLOCKED_COPY	(1024 * 1024)
+
+/* This is a little non-intuitive.  path_passwd gives the pathname of
  * the file which contains the encrypted password string.
- * PATH_PASSWD_LOCAL gives the local (authoritative) copy of
- * PATH_PASSWD.  PATH_PASSWD_LOCAL_TMP gives a temporary filename for
- * updating PATH_PASSWD_LOCAL.
+ * path_passwd_local gives the local (authoritative) copy of
+ * path_passwd.  path_passwd_local_tmp gives a lock file for updating
+ * path_passwd_local; it is named as a temporary file because it once
+ * also held the new copy.  set_root() sets them according to the
+ * passwd file format in use under a root directory.
  */
-#if defined(HAVE_MASTER_PASSWD)
-#define PATH_PASSWD		"/etc/master.passwd"
-#elif defined(HAVE_SHADOW)
-#define PATH_PASSWD		"/etc/shadow"
-#else
-#define PATH_PASSWD		"/etc/passwd"
-#endif
-#define PATH_PASSWD_LOCAL	PATH_PASSWD ".local"
-#define PATH_PASSWD_LOCAL_TMP	PATH_PASSWD_LOCAL ".tmp"
+static const char *path_passwd;
+static const char *path_passwd_local;
+static const char *path_passwd_local_tmp;
 
-/* Temp file should be mode 600 on a master.passwd or shadow system,
- * 644 otherwise.
+/* While updating, path_passwd_local_new is the new local passwd file
+ * we are writing, if any, and have_lock says whether we have created
+ * path_passwd_local_tmp.  cleanup() removes both.
  */
-#if defined(HAVE_MASTER_PASSWD) || defined(HAVE_SHADOW)
-#define PLTMP_MODE (S_IWUSR|S_IRUSR)
-#else
-#define PLTMP_MODE (S_IWUSR|S_IRUSR|S_IRGRP|S_IROTH)
-#endif
+static char *path_passwd_local_new;
+static int have_lock;
+
+/* The passwd file formats we know about, in order of preference; a
+ * system uses the first one whose file exists.  The new local passwd
+ * file should be mode 600 on a master.passwd or shadow system, 644
+ * otherwise.
+ */
+static const struct passwd_format {
+  const char *path;		/* Pathname of the passwd file */
+  int nfields;			/* Colon-separated fields in an entry */
+  mode_t tmp_mode;		/* Mode of the new path_passwd_local */
+} formats[] = {
+  { "/etc/master.passwd", 10, S_IWUSR|S_IRUSR },
+  { "/etc/shadow", 9, S_IWUSR|S_IRUSR },
+  { "/etc/passwd", 7, S_IWUSR|S_IRUSR|S_IRGRP|S_IROTH }
+};
+#define NFORMATS ((int) (sizeof(formats) / sizeof(formats[0])))
 
-static void update_passwd_local(const char *username);
-static int read_line(FILE *fp, char **buf, int *bufsize);
+/* The format in use, also set by set_root(). */
+static const struct passwd_format *format;
+
+/* An entry to be propagated into the local passwd file. */
+struct local_update {
+  const char *username;
+  const char *line;		/* New line, in the passwd file mapping */
+  size_t len;			/* Length of line */
+  int seen;			/* Seen in the local passwd file yet? */
+};
+
+/* A file mapped into memory, to be read a line at a time.  The file
+ * is kept open while it is mapped, so that its inode number can't be
+ * reused by another file in the meantime.
+ */
+struct mapped_file {
+  int fd;			/* Descriptor for the file */
+  char *base;			/* Start of the mapping, NULL if empty */
+  off_t size;			/* Size of the file */
+  off_t pos;			/* Offset of the next line */
+  struct stat st;		/* Status of the file when mapped */
+};
+
+/* Phases of a run which are timed. */
+enum phase {
+  PHASE_GETPW,			/* Looking up the running user */
+  PHASE_ACCESS,			/* Checking /etc/athena/access */
+  PHASE_CHILD,			/* Running the password-changing program */
+  PHASE_SCAN,			/* Scanning path_passwd */
+  PHASE_CHECK,			/* Checking path_passwd_local for changes */
+  PHASE_COPY,			/* Copying path_passwd_local */
+  PHASE_LOCK,			/* Waiting for path_passwd_local_tmp */
+  PHASE_RENAME,			/* Validating and renaming the new file */
+  NPHASES
+};
+
+static const char *const phase_names[NPHASES] = {
+  "getpw", "access", "child", "scan", "check", "copy", "lock", "rename"
+};
+
+/* Facts about this run which matter for its timing, logged via syslog
+ * at LOG_DEBUG so that load patterns can be captured if desired, and
+ * reported on stderr if -t is given.
+ */
+static struct run_stats {
+  const char *mode;		/* "local", "update", or "kerberos" */
+  const char *outcome;		/* What happened, e.g. "updated" */
+  int nusers;			/* Users to be updated */
+  int nfound;			/* Users found in path_passwd */
+  off_t passwd_size;		/* Size of path_passwd */
+  off_t local_size;		/* Size of path_passwd_local */
+  int lock_retries;		/* Times we waited for the lock */
+  int conflicts;		/* Times path_passwd_local changed under us */
+  struct timespec lock_start;	/* When we got the lock */
+  double lock_hold;		/* Seconds we held the lock */
+  off_t bytes_copied;		/* Size of the new path_passwd_local */
+  double phase_time[NPHASES];	/* Seconds spent in each phase */
+  struct timespec phase_start;	/* Start of the current phase */
+  int timing;			/* Report on stderr? */
+} stats;
+
+static int update_passwd_local(const char **usernames, int n);
+static int update_roots(const char **roots, int nroots, int jobs,
+			const char **usernames, int n);
+static int set_root(const char *root);
+static char *root_path(const char *root, const char *path,
+		       const char *suffix);
+static int read_usernames(FILE *fp, const char ***usernames, int *n);
+static struct local_update *find_update(struct local_update *updates,
+					int n, const char *line, size_t len);
+static int write_new_local(struct local_update *updates, int n,
+			   const sigset_t *mask, struct mapped_file *mf);
+static void remove_new_local(const sigset_t *mask);
+static int lock_local(const sigset_t *mask);
+static void unlock_local(const sigset_t *mask);
+static void remove_stale_copies(void);
+static int same_file(const struct stat *a, const struct stat *b);
+static int map_file(const char *path, struct mapped_file *mf);
+static int next_line(struct mapped_file *mf, const char **line,
+		     size_t *len);
+static void unmap_file(struct mapped_file *mf);
+static int count_fields(const char *line, size_t len);
+static int compare_updates(const void *a, const void *b);
+static int compare_line_update(const void *key, const void *elem);
+static void phase_begin(enum phase phase);
+static void phase_end(enum phase phase);
+static void lock_acquired(void);
+static void lock_released(void);
+static long long ns_since(const struct timespec *start);
+static void log_stats(int status);
 static void usage(void);
 static void cleanup(int sig);
+static void read_fault(int sig);
+static void remove_files(void);
 
 int main(int argc, char **argv)
 {
   extern int optind;
-  int c, local = 0, krb = 0, rval, status, n;
+  int c, local = 0, krb = 0, update = 0, rval, status, n, nroots = 0;
+  int jobs = 0;
   char *args[4], *runner, *username;
+  const char **usernames, **roots;
   pid_t pid;
   uid_t ruid = getuid();
   struct passwd *pwd;
 
-  while ((c = getopt(argc, argv, "lk")) != -1)
+  roots = malloc(argc * sizeof(char *));
+  if (!roots)
+    {
+      fprintf(stderr, "passwd: out of memory.\n");
+      return 1;
+    }
+  while ((c = getopt(argc, argv, "lkutr:j:")) != -1)
     {
       switch (c)
 	{
@@ -85,21 +209,91 @@ int main(int argc, char **argv)
 	case 'k':
 	  krb = 1;
 	  break;
+	case 'u':
+	  update = 1;
+	  break;
+	case 't':
+	  stats.timing = 1;
+	  break;
+	case 'r':
+	  roots[nroots++] = optarg;
+	  break;
+	case 'j':
+	  jobs = atoi(optarg);
+	  if (jobs < 1)
+	    usage();
+	  break;
 	default:
 	  usage();
 	}
     }
   argc -= optind;
   argv += optind;
-  if ((local && krb) || argc > 1)
+  if ((local && krb) || (update && (local || krb)) || (!update && argc > 1)
+      || (!update && nroots > 0) || (jobs > 0 && nroots == 0))
     usage();
+  if (jobs == 0)
+    jobs = 1;
+
+  /* The -t report describes root-only files, such as the size of the
+   * local shadow file, so don't give it to other users.
+   */
+  if (stats.timing && ruid != 0)
+    {
+      fprintf(stderr, "passwd: only root may use -t.\n");
+      return 1;
+    }
+
+  openlog("passwd", LOG_PID, LOG_AUTH);
+
+  /* In update-only mode, skip the password-changing programs and just
+   * propagate the users' current passwd entries into the local passwd
+   * file.  This lets other tools which change passwd entries (usermod,
+   * chage, chpasswd, configuration management) keep the local file in
+   * sync.  If no usernames are given, read them from stdin, one per
+   * line; anything after a colon is ignored, so chpasswd input can be
+   * used as is.
+   */
+  if (update)
+    {
+      if (ruid != 0)
+	{
+	  fprintf(stderr, "passwd: only root may use -u.\n");
+	  return 1;
+	}
+      if (argc > 0)
+	{
+	  usernames = (const char **) argv;
+	  n = argc;
+	}
+      else if (read_usernames(stdin, &usernames, &n) == -1)
+	{
+	  fprintf(stderr, "passwd: error reading usernames from stdin.\n");
+	  return 1;
+	}
+      if (n == 0)
+	return 0;
+      stats.mode = "update";
+      if (nroots > 0)
+	return (update_roots(roots, nroots, jobs, usernames, n) == 0) ? 0 : 1;
+      if (set_root("") == -1)
+	{
+	  fprintf(stderr, "passwd: out of memory.\n");
+	  return 1;
+	}
+      rval = update_passwd_local(usernames, n);
+      log_stats(rval);
+      return (rval == 0) ? 0 : 1;
+    }
 
   /* Figure out the username who is allegedly running this program.
    * Unfortunately, getenv("USER") yields the wrong answer if the user
    * has done an "su", so fall back to that only if ruid isn't in the
    * passwd file.
    */
+  phase_begin(PHASE_GETPW);
   pwd = getpwuid(ruid);
+  phase_end(PHASE_GETPW);
   if (pwd)
     runner = pwd->pw_name;
   else
@@ -130,8 +324,10 @@ int main(int argc, char **argv)
        * then we use the local passwd program; otherwise we use
        * kpasswd.
        */
+      phase_begin(PHASE_ACCESS);
       if (ruid == 0 || al_is_local_acct(runner) == 1)
 	local = 1;
+      phase_end(PHASE_ACCESS);
     }
 
   if (local)
@@ -147,7 +343,9 @@ int main(int argc, char **argv)
        */
       if (ruid != 0)
 	{
+	  phase_begin(PHASE_GETPW);
 	  pwd = getpwnam(username);
+	  phase_end(PHASE_GETPW);
 	  if (!pwd)
 	    {
 	      fprintf(stderr, "passwd: Can't find uid for username %s.\n",
@@ -164,6 +362,8 @@ int main(int argc, char **argv)
 	}
 
       printf("Running local password-changing program for %s.\n", username);
+      stats.mode = "local";
+      phase_begin(PHASE_CHILD);
       pid = fork();
       if (pid == -1)
 	{
@@ -172,6 +372,7 @@ int main(int argc, char **argv)
 	}
       else if (pid == 0)
 	{
+	  closelog();
 	  setuid(ruid);
 	  n = 0;
 	  args[n++] = "passwd";
@@ -198,6 +399,7 @@ int main(int argc, char **argv)
 	  /* Wait for the child to complete. */
 	  while ((rval = waitpid(pid, &status, 0)) == -1 && errno == EINTR)
 	    ;
+	  phase_end(PHASE_CHILD);
 	  if (rval == -1)
 	    {
 	      perror("passwd: wait");
@@ -207,15 +409,32 @@ int main(int argc, char **argv)
 	   * error message.
 	   */
 	  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
-	    return 1;
+	    {
+	      stats.outcome = "child-failed";
+	      log_stats(-1);
+	      return 1;
+	    }
 
-	  update_passwd_local(username);
-	  return 0;
+	  if (set_root("") == -1)
+	    {
+	      fprintf(stderr, "passwd: out of memory.\n");
+	      return 1;
+	    }
+	  usernames = (const char **) &username;
+	  rval = update_passwd_local(usernames, 1);
+	  log_stats(rval);
+	  return (rval == 0) ? 0 : 1;
 	}
     }
   else
     {
       printf("Running Kerberos password-changing program.\n");
+      stats.mode = "kerberos";
+      stats.outcome = "exec";
+      log_stats(0);
+
+      /* Don't leave the syslog socket open across the exec. */
+      closelog();
       setuid(ruid);
       args[0] = "kpasswd";
       if (*argv)
@@ -231,205 +450,1004 @@ int main(int argc, char **argv)
     }
 }
 
-static void update_passwd_local(const char *username)
+/* Update the local passwd file with the current entries for the n
+ * users in usernames from the passwd file, reading and rewriting each
+ * file only once.  Returns 0 on success or if there was nothing to
+ * update, and -1 (having printed an error message) on failure.  If
+ * some users can't be found in the passwd file, the others are still
+ * updated, but -1 is returned.
+ */
+static int update_passwd_local(const char **usernames, int n)
 {
-  FILE *fp, *fp_out;
-  char *line = NULL, *userline;
-  int linesize, len, found, fd, i, status;
-  struct sigaction action;
+  const char *line;
+  size_t len;
+  int nfound, changed, i, j, attempt, locked, unlocked, status, rval = 0;
+  struct local_update *updates, *u;
+  struct mapped_file pmf, mf;
+  struct stat cur;
+  struct sigaction action, oaction[4], obus;
   sigset_t mask, omask;
-  mode_t oldumask;
+  static const int sigs[4] = { SIGHUP, SIGINT, SIGQUIT, SIGTERM };
 
-  len = strlen(username);
+  if (n == 0)
+    return 0;
 
-  /* Find the line for username in the passwd file. */
-  fp = fopen(PATH_PASSWD, "r");
-  if (fp == NULL)
+  /* Sort the usernames so we can look up each line with a binary
+   * search, and drop any duplicates.
+   */
+  updates = malloc(n * sizeof(struct local_update));
+  if (!updates)
+    {
+      stats.outcome = "nomem";
+      fprintf(stderr, "Out of memory so not updating local passwd file.\n");
+      return -1;
+    }
+  for (i = 0; i < n; i++)
+    {
+      updates[i].username = usernames[i];
+      updates[i].line = NULL;
+      updates[i].seen = 0;
+    }
+  qsort(updates, n, sizeof(struct local_update), compare_updates);
+  for (i = 1, j = 1; i < n; i++)
     {
-      fprintf(stderr, "Can't open %s so not updating local passwd file.\n",
-	      PATH_PASSWD);
-      exit(1);
+      if (strcmp(updates[i].username, updates[j - 1].username) != 0)
+	updates[j++] = updates[i];
     }
-  found = 0;
-  while (read_line(fp, &line, &linesize) == 0)
+  n = j;
+  stats.nusers = n;
+
+  /* Our mappings are of files which others may change while we read
+   * them.  If one is truncated, touching the pages past its new end
+   * raises SIGBUS; make sure that doesn't leave our new local passwd
+   * file or the lock file behind.
+   */
+  sigemptyset(&action.sa_mask);
+  action.sa_handler = read_fault;
+  action.sa_flags = 0;
+  sigaction(SIGBUS, &action, &obus);
+
+  /* Find the lines for the users in the passwd file.  Use the first
+   * line for each user.
+   */
+  phase_begin(PHASE_SCAN);
+  if (map_file(path_passwd, &pmf) == -1)
     {
-      if (strncmp(line, username, len) == 0 && line[len] == ':')
+      fprintf(stderr, "Can't open %s (%s) so not updating local passwd "
+	      "file.\n", path_passwd, strerror(errno));
+      phase_end(PHASE_SCAN);
+      stats.outcome = "passwd-error";
+      sigaction(SIGBUS, &obus, NULL);
+      free(updates);
+      return -1;
+    }
+  stats.passwd_size = pmf.size;
+  nfound = 0;
+  while (nfound < n && next_line(&pmf, &line, &len))
+    {
+      u = find_update(updates, n, line, len);
+      if (u && !u->line)
 	{
-	  found = 1;
-	  break;
+	  DTRACE_PROBE1(passwd, scan__match, u->username);
+	  u->line = line;
+	  u->len = len;
+	  nfound++;
 	}
     }
-  if (!found)
+  phase_end(PHASE_SCAN);
+  stats.nfound = nfound;
+  for (i = 0; i < n; i++)
     {
-      fprintf(stderr,
-	      "Can't find %s in %s so not updating local passwd file.\n",
-	      username, PATH_PASSWD);
-      exit(1);
+      if (!updates[i].line)
+	{
+	  fprintf(stderr,
+		  "Can't find %s in %s so not updating local passwd file.\n",
+		  updates[i].username, path_passwd);
+	  rval = -1;
+	}
+      else if (count_fields(updates[i].line, updates[i].len)
+	       != format->nfields)
+	{
+	  /* Don't propagate a damaged entry into the local passwd
+	   * file, where it would outlive any repair to path_passwd.
+	   */
+	  fprintf(stderr, "Entry for %s in %s does not have %d fields so "
+		  "not updating local passwd file.\n", updates[i].username,
+		  path_passwd, format->nfields);
+	  updates[i].line = NULL;
+	  nfound--;
+	  rval = -1;
+	}
+    }
+  if (nfound == 0)
+    {
+      stats.outcome = "not-found";
+      goto done;
     }
-  fclose(fp);
-  userline = line;
-  line = NULL;
 
-  /* Open the local passwd file for reading. */
-  fp = fopen(PATH_PASSWD_LOCAL, "r");
-  if (fp == NULL)
+  /* Check the local passwd file for out-of-date entries for the users
+   * before taking the lock, so that we don't contend for the lock or
+   * rewrite the file when there is nothing to change.  If there is no
+   * local passwd file, there is nothing to update.
+   */
+  phase_begin(PHASE_CHECK);
+  if (map_file(path_passwd_local, &mf) == -1)
     {
       if (errno != ENOENT)
-	fprintf(stderr, "Can't read %s so not updating local passwd file.\n",
-		PATH_PASSWD_LOCAL);
-      exit(1);
+	{
+	  fprintf(stderr, "Can't read %s (%s) so not updating local passwd "
+		  "file.\n", path_passwd_local, strerror(errno));
+	  stats.outcome = "local-error";
+	  rval = -1;
+	}
+      else
+	stats.outcome = "no-local-file";
+      phase_end(PHASE_CHECK);
+      goto done;
+    }
+  stats.local_size = mf.size;
+  changed = 0;
+  while (!changed && next_line(&mf, &line, &len))
+    {
+      u = find_update(updates, n, line, len);
+      if (u && !u->seen)
+	{
+	  u->seen = 1;
+	  if (u->line && (len != u->len || memcmp(line, u->line, len) != 0))
+	    changed = 1;
+	}
+    }
+  unmap_file(&mf);
+  for (i = 0; i < n; i++)
+    updates[i].seen = 0;
+  phase_end(PHASE_CHECK);
+  if (!changed)
+    {
+      stats.outcome = "unchanged";
+      goto done;
     }
 
   sigemptyset(&mask);
-  sigaddset(&mask, SIGHUP);
-  sigaddset(&mask, SIGINT);
-  sigaddset(&mask, SIGQUIT);
-  sigaddset(&mask, SIGTERM);
-
-  /* Open the temporary local passwd file for writing.  We have to do some
-   * clever signal-handling tricks to make sure that tty signals don't
-   * leave the lock file hanging around.
+  for (i = 0; i < 4; i++)
+    sigaddset(&mask, sigs[i]);
+
+  /* Make sure tty signals don't leave our new local passwd file or the
+   * lock file hanging around.  cleanup() removes whichever of them we
+   * have; we block the signals while that changes.
    */
-  for (i = 0; i < 10; i++)
+  sigemptyset(&action.sa_mask);
+  action.sa_handler = cleanup;
+  action.sa_flags = 0;
+  sigprocmask(SIG_BLOCK, &mask, &omask);
+  for (i = 0; i < 4; i++)
+    sigaction(sigs[i], &action, &oaction[i]);
+  sigprocmask(SIG_SETMASK, &omask, NULL);
+
+  /* Build the new local passwd file without holding the lock.  Then
+   * take the lock only long enough to check that the local passwd file
+   * hasn't been replaced or modified since we read it, and to rename
+   * the new one into place.  We still have the file we read open then,
+   * so a file which has replaced it can't have been given its inode
+   * number.  If it has changed, start over from its new contents.
+   * After a conflict, stop racing the other updaters: take the lock
+   * first and build the new file while holding it, so that we are sure
+   * to finish.
+   *
+   * Each unlocked copy is a full copy of the local passwd file in its
+   * directory, so if the file is large, or someone already has the
+   * lock and we would likely conflict with them, build the new file
+   * under the lock from the start.  That keeps the space used by
+   * concurrent updaters to one copy of a large file at a time.
+   */
+  unlocked = (stats.local_size <= MAX_UNLOCKED_COPY
+	      && stat(path_passwd_local_tmp, &cur) == -1 && errno == ENOENT);
+  for (attempt = 0; ; attempt++)
     {
-      sigprocmask(SIG_BLOCK, &mask, &omask);
-      oldumask = umask(0);
-      fd = open(PATH_PASSWD_LOCAL_TMP, O_RDWR|O_CREAT|O_EXCL, PLTMP_MODE);
-      umask(oldumask);
-      if (fd != -1)
+      locked = (attempt > 0 || !unlocked);
+      if (locked && lock_local(&mask) == -1)
+	{
+	  rval = -1;
+	  break;
+	}
+      status = write_new_local(updates, n, &mask, &mf);
+      if (status <= 0)
 	{
-	  sigemptyset(&action.sa_mask);
-	  action.sa_handler = cleanup;
-	  action.sa_flags = 0;
-	  sigaction(SIGHUP, &action, NULL);
-	  sigaction(SIGINT, &action, NULL);
-	  sigaction(SIGQUIT, &action, NULL);
-	  sigaction(SIGTERM, &action, NULL);
+	  if (status < 0)
+	    rval = -1;
+	  if (locked)
+	    unlock_local(&mask);
+	  break;
+	}
+      if (!locked && lock_local(&mask) == -1)
+	{
+	  unmap_file(&mf);
+	  remove_new_local(&mask);
+	  rval = -1;
+	  break;
 	}
+
+      phase_begin(PHASE_RENAME);
+      sigprocmask(SIG_BLOCK, &mask, NULL);
+      if (locked
+	  || (stat(path_passwd_local, &cur) == 0 && same_file(&mf.st, &cur)))
+	{
+	  /* Replace the local passwd file with the new one. */
+	  printf("Updating %s with new passwd %s.\n", path_passwd_local,
+		 (n == 1) ? "entry" : "entries");
+	  status = rename(path_passwd_local_new, path_passwd_local);
+	  stats.outcome = "updated";
+	  if (status == -1)
+	    {
+	      stats.outcome = "rename-error";
+	      fprintf(stderr, "Error renaming %s to %s so not updating local "
+		      "passwd file.\n", path_passwd_local_new,
+		      path_passwd_local);
+	      unlink(path_passwd_local_new);
+	      rval = -1;
+	    }
+	  free(path_passwd_local_new);
+	  path_passwd_local_new = NULL;
+	  unlink(path_passwd_local_tmp);
+	  have_lock = 0;
+	  sigprocmask(SIG_SETMASK, &omask, NULL);
+	  lock_released();
+	  unmap_file(&mf);
+	  phase_end(PHASE_RENAME);
+	  DTRACE_PROBE1(passwd, rename__done, status);
+	  break;
+	}
+
+      /* Someone else changed the local passwd file under us. */
+      unlink(path_passwd_local_new);
+      free(path_passwd_local_new);
+      path_passwd_local_new = NULL;
+      unlink(path_passwd_local_tmp);
+      have_lock = 0;
       sigprocmask(SIG_SETMASK, &omask, NULL);
-      if (fd != -1 || errno != EEXIST)
-	break;
-      sleep(1);
+      lock_released();
+      unmap_file(&mf);
+      phase_end(PHASE_RENAME);
+      stats.conflicts++;
+      DTRACE_PROBE1(passwd, commit__conflict, attempt);
     }
-  if (fd == -1 || (fp_out = fdopen(fd, "w")) == NULL)
+
+  for (i = 0; i < 4; i++)
+    sigaction(sigs[i], &oaction[i], NULL);
+  sigprocmask(SIG_SETMASK, &omask, NULL);
+
+done:
+  unmap_file(&pmf);
+  sigaction(SIGBUS, &obus, NULL);
+  free(updates);
+  return rval;
+}
+
+/* Update the local passwd files in each of the nroots root directories
+ * in roots, running up to jobs updates at a time in child processes.
+ * Returns 0 if all of the updates succeeded, or -1 otherwise.
+ */
+static int update_roots(const char **roots, int nroots, int jobs,
+			const char **usernames, int n)
+{
+  int i, running = 0, rval = 0, status;
+  pid_t pid;
+
+  /* Flush our output so the children don't duplicate it. */
+  fflush(stdout);
+  fflush(stderr);
+  for (i = 0; i < nroots || running > 0; )
     {
-      fprintf(stderr,
-	      "Can't open %s for writing so not updating local passwd file.\n",
-	      PATH_PASSWD_LOCAL_TMP);
-      if (fd != -1)
+      if (i < nroots && running < jobs)
 	{
-	  sigprocmask(SIG_BLOCK, &mask, NULL);
-	  unlink(PATH_PASSWD_LOCAL_TMP);
+	  pid = fork();
+	  if (pid == -1)
+	    {
+	      perror("passwd: fork");
+	      rval = -1;
+	      if (running == 0)
+		break;
+	    }
+	  else if (pid == 0)
+	    {
+	      if (set_root(roots[i]) == -1)
+		{
+		  fprintf(stderr, "passwd: out of memory.\n");
+		  exit(1);
+		}
+	      status = update_passwd_local(usernames, n);
+	      log_stats(status);
+	      exit((status == 0) ? 0 : 1);
+	    }
+	  else
+	    {
+	      running++;
+	      i++;
+	      continue;
+	    }
+	}
+
+      /* Wait for a child to complete. */
+      while ((pid = waitpid(-1, &status, 0)) == -1 && errno == EINTR)
+	;
+      if (pid == -1)
+	{
+	  perror("passwd: wait");
+	  return -1;
 	}
-      exit(1);
+      running--;
+      if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+	rval = -1;
+    }
+  return rval;
+}
+
+/* Use the passwd files under the directory root (which is "" for the
+ * system's own files), determining which passwd file format is in use
+ * there.  Returns 0 on success or -1 if we ran out of memory.
+ */
+static int set_root(const char *root)
+{
+  struct stat st;
+  char *path = NULL;
+  int i;
+
+  for (i = 0; i < NFORMATS; i++)
+    {
+      path = root_path(root, formats[i].path, "");
+      if (!path)
+	return -1;
+      if (i == NFORMATS - 1 || stat(path, &st) == 0)
+	break;
+      free(path);
     }
+  format = &formats[i];
+  path_passwd = path;
+  path_passwd_local = root_path(root, format->path, ".local");
+  path_passwd_local_tmp = root_path(root, format->path, ".local.tmp");
+  if (!path_passwd || !path_passwd_local || !path_passwd_local_tmp)
+    return -1;
+  return 0;
+}
 
-  /* Copy the local passwd file to the temporary file.  Replace the first
-   * line beginning with username with the line we found in the passwd
-   * file.
+/* Return a newly allocated copy of the absolute pathname path under
+ * the directory root with suffix appended, or NULL if we run out of
+ * memory.
+ */
+static char *root_path(const char *root, const char *path,
+		       const char *suffix)
+{
+  char *result;
+  int len = strlen(root);
+
+  /* Don't double up the slash if root ends in one. */
+  while (len > 0 && root[len - 1] == '/')
+    len--;
+  result = malloc(len + strlen(path) + strlen(suffix) + 1);
+  if (!result)
+    return NULL;
+  memcpy(result, root, len);
+  strcpy(result + len, path);
+  strcat(result, suffix);
+  return result;
+}
+
+/* Write a new local passwd file, with the entries for the n users in
+ * updates replaced, to a uniquely named file beside the local passwd
+ * file, whose name is left in path_passwd_local_new.  tty signals in
+ * mask are blocked while path_passwd_local_new changes.  Returns 1 if
+ * the new file was written, 0 if there was nothing to change, or -1
+ * (having printed an error message) on failure.  If 1 is returned, the
+ * local passwd file as it was read is left mapped in *mf, for the
+ * caller to check against and unmap.
+ */
+static int write_new_local(struct local_update *updates, int n,
+			   const sigset_t *mask, struct mapped_file *mf)
+{
+  FILE *fp;
+  char *path;
+  const char *line, *span;
+  size_t len;
+  struct local_update *u;
+  sigset_t omask;
+  int fd, i, err, changed = 0;
+
+  phase_begin(PHASE_COPY);
+  if (map_file(path_passwd_local, mf) == -1)
+    {
+      phase_end(PHASE_COPY);
+      if (errno == ENOENT)
+	{
+	  stats.outcome = "no-local-file";
+	  return 0;
+	}
+      fprintf(stderr, "Can't read %s (%s) so not updating local passwd "
+	      "file.\n", path_passwd_local, strerror(errno));
+      stats.outcome = "local-error";
+      return -1;
+    }
+  path = malloc(strlen(path_passwd_local) + 22);
+  if (!path)
+    {
+      unmap_file(mf);
+      phase_end(PHASE_COPY);
+      fprintf(stderr, "Out of memory so not updating local passwd file.\n");
+      stats.outcome = "nomem";
+      return -1;
+    }
+  /* Name the new file after our process ID, so that
+   * remove_stale_copies() can tell if we have died without removing
+   * it.  A file which already has that name was left by an earlier
+   * process with our ID.
    */
-  found = 0;
-  while ((status = read_line(fp, &line, &linesize)) == 0)
+  sprintf(path, "%s.%lu", path_passwd_local, (unsigned long) getpid());
+  sigprocmask(SIG_BLOCK, mask, &omask);
+  fd = open(path, O_WRONLY|O_CREAT|O_EXCL, S_IWUSR|S_IRUSR);
+  if (fd == -1 && errno == EEXIST && unlink(path) == 0)
+    fd = open(path, O_WRONLY|O_CREAT|O_EXCL, S_IWUSR|S_IRUSR);
+  if (fd != -1)
+    path_passwd_local_new = path;
+  sigprocmask(SIG_SETMASK, &omask, NULL);
+  if (fd == -1 || fchmod(fd, format->tmp_mode) == -1
+      || (fp = fdopen(fd, "w")) == NULL)
     {
-      if (!found && strncmp(line, username, len) == 0 && line[len] == ':')
+      fprintf(stderr, "Can't create %s (%s) so not updating local passwd "
+	      "file.\n", path, strerror(errno));
+      if (fd != -1)
 	{
-	  fputs(userline, fp_out);
-	  found = 1;
+	  close(fd);
+	  remove_new_local(mask);
 	}
       else
-	fputs(line, fp_out);
-      putc('\n', fp_out);
+	free(path);
+      unmap_file(mf);
+      phase_end(PHASE_COPY);
+      stats.outcome = "create-error";
+      return -1;
     }
-  free(line);
-  free(userline);
-  fclose(fp);
 
-  /* Block tty signals for the short duration of our lifetime so we don't
-   * erroneously delete the temporary file after giving it up.
+  /* Copy the local passwd file, replacing the first line beginning
+   * with each username with the line we found in the passwd file.
+   * Runs of lines which aren't replaced are written straight from the
+   * mapping.
    */
-  sigprocmask(SIG_BLOCK, &mask, NULL);
+  for (i = 0; i < n; i++)
+    updates[i].seen = 0;
+  span = mf->base;
+  while (next_line(mf, &line, &len))
+    {
+      u = find_update(updates, n, line, len);
+      if (u && !u->seen && u->line)
+	{
+	  fwrite(span, 1, line - span, fp);
+	  fwrite(u->line, 1, u->len, fp);
+	  putc('\n', fp);
+	  span = mf->base + mf->pos;
+	  changed = 1;
+	}
+      if (u)
+	u->seen = 1;
+    }
 
-  if (!found)
+  /* Write out the rest, making sure the last line is terminated. */
+  if (span < mf->base + mf->size)
     {
-      /* We didn't actually change the file; don't do an update. */
-      fclose(fp_out);
-      unlink(PATH_PASSWD_LOCAL_TMP);
-      return;
+      fwrite(span, 1, mf->base + mf->size - span, fp);
+      if (mf->base[mf->size - 1] != '\n')
+	putc('\n', fp);
     }
 
-  if (status < 0 || ferror(fp_out) || fclose(fp_out) == EOF)
+  stats.bytes_copied = ftello(fp);
+  err = ferror(fp);
+  if (fclose(fp) == EOF)
+    err = 1;
+  phase_end(PHASE_COPY);
+  if (!changed)
+    {
+      /* We didn't actually change the file; don't do an update. */
+      unmap_file(mf);
+      remove_new_local(mask);
+      stats.outcome = "unchanged";
+      return 0;
+    }
+  if (err)
     {
       fprintf(stderr,
 	      "Error copying %s to %s so not updating local passwd file.\n",
-	      PATH_PASSWD_LOCAL, PATH_PASSWD_LOCAL_TMP);
-      unlink(PATH_PASSWD_LOCAL_TMP); 
-      exit(1);
+	      path_passwd_local, path_passwd_local_new);
+      unmap_file(mf);
+      remove_new_local(mask);
+      stats.outcome = "copy-error";
+      return -1;
     }
+  return 1;
+}
+
+/* Remove the new local passwd file written by write_new_local(). */
+static void remove_new_local(const sigset_t *mask)
+{
+  sigset_t omask;
+
+  sigprocmask(SIG_BLOCK, mask, &omask);
+  unlink(path_passwd_local_new);
+  free(path_passwd_local_new);
+  path_passwd_local_new = NULL;
+  sigprocmask(SIG_SETMASK, &omask, NULL);
+}
+
+/* Take the lock on the local passwd file by creating
+ * path_passwd_local_tmp, waiting if someone else has it.  We give up
+ * if the same lock file has been there for ten seconds, but keep
+ * waiting as long as it is being released and taken again by others,
+ * since then they are making progress.  tty signals in mask are
+ * blocked while have_lock changes.  Returns 0 on success or -1 (having
+ * printed an error message) on failure.
+ */
+static int lock_local(const sigset_t *mask)
+{
+  sigset_t omask;
+  mode_t oldumask;
+  struct stat st, holder;
+  int fd, i, err, waited = 0;
 
-  /* Replace the local passwd file with the temporary file. */
-  printf("Updating %s with new passwd entry.\n", PATH_PASSWD_LOCAL);
-  if (rename(PATH_PASSWD_LOCAL_TMP, PATH_PASSWD_LOCAL) == -1)
+  phase_begin(PHASE_LOCK);
+  holder.st_ino = 0;
+  holder.st_ctime = 0;
+  for (i = 0; ; i++)
     {
-      fprintf(stderr,
-	      "Error renaming %s to %s so not updating local passwd file.\n",
-	      PATH_PASSWD_LOCAL, PATH_PASSWD_LOCAL_TMP);
-      unlink(PATH_PASSWD_LOCAL_TMP);
-      exit(1);
+      DTRACE_PROBE1(passwd, lock__attempt, i);
+      sigprocmask(SIG_BLOCK, mask, &omask);
+      oldumask = umask(0);
+      fd = open(path_passwd_local_tmp, O_RDWR|O_CREAT|O_EXCL,
+		format->tmp_mode);
+      err = errno;
+      umask(oldumask);
+      if (fd != -1)
+	{
+	  have_lock = 1;
+	  lock_acquired();
+	}
+      sigprocmask(SIG_SETMASK, &omask, NULL);
+      if (fd != -1 || err != EEXIST)
+	break;
+      if (stat(path_passwd_local_tmp, &st) == 0
+	  && (st.st_ino != holder.st_ino || st.st_ctime != holder.st_ctime))
+	{
+	  holder = st;
+	  waited = 0;
+	}
+      if (waited++ == 10)
+	break;
+      stats.lock_retries++;
+      DTRACE_PROBE1(passwd, lock__sleep, i);
+      sleep(1);
+    }
+  phase_end(PHASE_LOCK);
+  if (fd == -1)
+    {
+      /* Distinguish a lock held by someone else for the whole retry
+       * period from other failures, since the cure is different.
+       */
+      if (err == EEXIST)
+	{
+	  fprintf(stderr, "Timed out waiting for lock file %s so not "
+		  "updating local passwd file.\n", path_passwd_local_tmp);
+	  stats.outcome = "lock-timeout";
+	}
+      else
+	{
+	  fprintf(stderr, "Can't open %s for writing (%s) so not updating "
+		  "local passwd file.\n", path_passwd_local_tmp,
+		  strerror(err));
+	  stats.outcome = "lock-error";
+	}
+      return -1;
     }
+  close(fd);
+  remove_stale_copies();
+  return 0;
 }
 
-/* Read a line from a file into a dynamically allocated buffer,
- * zeroing the trailing newline if there is one.  The calling routine
- * may call read_line multiple times with the same buf and bufsize
- * pointers; *buf will be reallocated and *bufsize adjusted as
- * appropriate.  The initial value of *buf should be NULL.  After the
- * calling routine is done reading lines, it should free *buf.  This
- * function returns 0 if a line was successfully read, 1 if the file
- * ended, and -1 if there was an I/O error or if it ran out of memory.
- */
+/* Release the lock taken by lock_local(). */
+static void unlock_local(const sigset_t *mask)
+{
+  sigset_t omask;
 
-static int read_line(FILE *fp, char **buf, int *bufsize)
+  sigprocmask(SIG_BLOCK, mask, &omask);
+  unlink(path_passwd_local_tmp);
+  have_lock = 0;
+  sigprocmask(SIG_SETMASK, &omask, NULL);
+  lock_released();
+}
+
+/* Remove new local passwd files left behind by updaters which died
+ * before renaming or removing them, such as by SIGKILL or a crash.
+ * The files are named after the local passwd file with the process ID
+ * of their writer appended; those whose writer is still running are
+ * left alone, since it may be building its copy without the lock.
+ * This assumes that all updaters of the file run on this system.
+ * Called with the lock held.
+ */
+static void remove_stale_copies(void)
 {
-  char *newbuf;
-  int offset = 0, len;
+  char *dir, *base, *end, *path;
+  size_t len;
+  DIR *dp;
+  struct dirent *d;
+  long pid;
 
-  if (*buf == NULL)
+  dir = strdup(path_passwd_local);
+  if (!dir)
+    return;
+  base = strrchr(dir, '/');
+  *base++ = 0;
+  len = strlen(base);
+  dp = opendir(*dir ? dir : "/");
+  if (!dp)
     {
-      *buf = malloc(128);
-      if (!*buf)
-	return -1;
-      *bufsize = 128;
+      free(dir);
+      return;
     }
+  while ((d = readdir(dp)) != NULL)
+    {
+      if (strncmp(d->d_name, base, len) != 0 || d->d_name[len] != '.'
+	  || d->d_name[len + 1] < '0' || d->d_name[len + 1] > '9')
+	continue;
+      pid = strtol(d->d_name + len + 1, &end, 10);
+      if (*end || pid <= 0 || pid == (long) getpid()
+	  || kill((pid_t) pid, 0) == 0 || errno != ESRCH)
+	continue;
+      path = root_path(dir, "/", d->d_name);
+      if (path)
+	{
+	  unlink(path);
+	  free(path);
+	}
+    }
+  closedir(dp);
+  free(dir);
+}
+
+/* Return true if a and b are the status of the same file with the same
+ * contents, as far as we can tell.  A file replaced by rename() has a
+ * new inode number as long as the old file is still open.  One
+ * modified in place has a new change time, unless the change came
+ * within the timestamp granularity of the file system; we only ever
+ * replace the local passwd file, so only some other program editing it
+ * in place could get by unnoticed that way.
+ */
+static int same_file(const struct stat *a, const struct stat *b)
+{
+  if (a->st_dev != b->st_dev || a->st_ino != b->st_ino
+      || a->st_size != b->st_size || a->st_mtime != b->st_mtime
+      || a->st_ctime != b->st_ctime)
+    return 0;
+#ifdef HAVE_STRUCT_STAT_ST_MTIM
+  if (a->st_mtim.tv_nsec != b->st_mtim.tv_nsec
+      || a->st_ctim.tv_nsec != b->st_ctim.tv_nsec)
+    return 0;
+#endif
+  return 1;
+}
 
-  while (1)
+/* Read usernames from fp, one per line, ignoring anything after a
+ * colon and skipping empty lines.  The input is read into a single
+ * buffer which is split up in place and lasts for the rest of the run,
+ * so no allocation is done per username.  On success, *usernames is
+ * set to a newly allocated array of *n usernames, and 0 is returned.
+ * On error, -1 is returned.
+ */
+static int read_usernames(FILE *fp, const char ***usernames, int *n)
+{
+  char *buf = NULL, *newbuf, *p, *end, *nl, *colon;
+  const char **names;
+  size_t size = 0, len = 0, nread, count;
+
+  /* Read all of the input, leaving room for a terminating nul. */
+  do
     {
-      if (!fgets(*buf + offset, *bufsize - offset, fp))
-	return (offset != 0) ? 0 : (ferror(fp)) ? -1 : 1;
-      len = offset + strlen(*buf + offset);
-      if ((*buf)[len - 1] == '\n')
+      if (len == size)
 	{
-	  (*buf)[len - 1] = 0;
-	  return 0;
+	  size = (size == 0) ? 4096 : size * 2;
+	  newbuf = realloc(buf, size);
+	  if (!newbuf)
+	    {
+	      free(buf);
+	      return -1;
+	    }
+	  buf = newbuf;
 	}
-      offset = len;
+      nread = fread(buf + len, 1, size - len, fp);
+      len += nread;
+    }
+  while (nread > 0);
+  if (ferror(fp))
+    {
+      free(buf);
+      return -1;
+    }
 
-      /* Allocate more space. */
-      newbuf = realloc(*buf, *bufsize * 2);
-      if (!newbuf)
-	return -1;
-      *buf = newbuf;
-      *bufsize *= 2;
+  /* There can be no more usernames than there are lines. */
+  end = buf + len;
+  count = 1;
+  for (p = buf; (p = memchr(p, '\n', end - p)) != NULL; p++)
+    count++;
+  names = malloc(count * sizeof(char *));
+  if (!names)
+    {
+      free(buf);
+      return -1;
+    }
+
+  count = 0;
+  for (p = buf; p < end; p = nl + 1)
+    {
+      nl = memchr(p, '\n', end - p);
+      if (!nl)
+	nl = end;
+      *nl = 0;
+      colon = strchr(p, ':');
+      if (colon)
+	*colon = 0;
+      if (*p)
+	names[count++] = p;
+    }
+  *usernames = names;
+  *n = count;
+  return 0;
+}
+
+/* Look up the user whose passwd entry is the len bytes at line in the
+ * sorted array of n updates.  Returns NULL if line is not an entry for
+ * any of the users.
+ */
+static struct local_update *find_update(struct local_update *updates,
+					int n, const char *line, size_t len)
+{
+  if (!memchr(line, ':', len))
+    return NULL;
+  return bsearch(line, updates, n, sizeof(struct local_update),
+		 compare_line_update);
+}
+
+/* Map the file path into memory for reading, keeping it open until it
+ * is unmapped.  Returns 0 on success, or -1 with errno set on failure.
+ * The whole file is mapped, so on a system with a 32-bit address space
+ * a file which doesn't fit fails with EFBIG (or ENOMEM from mmap)
+ * rather than being truncated.
+ */
+static int map_file(const char *path, struct mapped_file *mf)
+{
+  struct stat st;
+  int fd, saved_errno;
+
+  fd = open(path, O_RDONLY);
+  if (fd == -1)
+    return -1;
+  if (fstat(fd, &st) == -1)
+    goto error;
+  mf->st = st;
+  if ((off_t) (size_t) st.st_size != st.st_size)
+    {
+      errno = EFBIG;
+      goto error;
+    }
+  mf->base = NULL;
+  mf->size = st.st_size;
+  mf->pos = 0;
+  if (mf->size > 0)
+    {
+      mf->base = mmap(NULL, mf->size, PROT_READ, MAP_SHARED, fd, 0);
+      if (mf->base == MAP_FAILED)
+	goto error;
+    }
+  mf->fd = fd;
+  return 0;
+
+error:
+  saved_errno = errno;
+  close(fd);
+  errno = saved_errno;
+  return -1;
+}
+
+/* Point *line at the next line of mf and set *len to its length, not
+ * including the newline.  Returns 1 if there was a line, or 0 at the
+ * end of the file.  The line is not nul-terminated.
+ */
+static int next_line(struct mapped_file *mf, const char **line,
+		     size_t *len)
+{
+  const char *start, *end, *nl;
+
+  if (mf->pos >= mf->size)
+    return 0;
+  start = mf->base + mf->pos;
+  end = mf->base + mf->size;
+  nl = memchr(start, '\n', end - start);
+  *line = start;
+  *len = (nl ? nl : end) - start;
+  mf->pos += *len + (nl ? 1 : 0);
+  return 1;
+}
+
+static void unmap_file(struct mapped_file *mf)
+{
+  if (mf->base)
+    munmap(mf->base, mf->size);
+  close(mf->fd);
+}
+
+/* Return the number of colon-separated fields in the len bytes at
+ * line.
+ */
+static int count_fields(const char *line, size_t len)
+{
+  const char *end = line + len;
+  int n = 1;
+
+  while ((line = memchr(line, ':', end - line)) != NULL)
+    {
+      n++;
+      line++;
+    }
+  return n;
+}
+
+static int compare_updates(const void *a, const void *b)
+{
+  const struct local_update *ua = a, *ub = b;
+
+  return strcmp(ua->username, ub->username);
+}
+
+/* Compare the username field of a passwd line (which must contain a
+ * colon) against the username of an update.  The line may contain nul
+ * bytes, so stop at the end of the username as well as at the colon.
+ */
+static int compare_line_update(const void *key, const void *elem)
+{
+  const unsigned char *l = key;
+  const unsigned char *u = (const unsigned char *)
+    ((const struct local_update *) elem)->username;
+
+  while (*u && *l != ':' && *l == *u)
+    {
+      l++;
+      u++;
+    }
+  if (*l == ':')
+    return (*u == 0) ? 0 : -1;
+  return (*u == 0) ? 1 : (int) *l - (int) *u;
+}
+
+/* Phases are timed with the monotonic clock so that changes to the
+ * system time don't skew them.  Phases don't nest; a phase may be
+ * timed more than once, in which case its times are added together.
+ * The passwd:phase-begin and passwd:phase-end probes fire with the
+ * phase name, and for phase-end the phase's elapsed time in
+ * nanoseconds.
+ */
+static void phase_begin(enum phase phase)
+{
+  (void) phase;			/* Unused without probes */
+  DTRACE_PROBE1(passwd, phase__begin, phase_names[phase]);
+  clock_gettime(CLOCK_MONOTONIC, &stats.phase_start);
+}
+
+static void phase_end(enum phase phase)
+{
+  long long ns;
+
+  ns = ns_since(&stats.phase_start);
+  stats.phase_time[phase] += ns / 1e9;
+  DTRACE_PROBE2(passwd, phase__end, phase_names[phase], ns);
+}
+
+/* Time how long we hold the lock on the local passwd file, from
+ * creating path_passwd_local_tmp to removing it.  The time
+ * spent waiting for the lock is the "lock" phase.  The
+ * passwd:lock-release probe fires with the hold time in nanoseconds.
+ */
+static void lock_acquired(void)
+{
+  clock_gettime(CLOCK_MONOTONIC, &stats.lock_start);
+}
+
+static void lock_released(void)
+{
+  long long ns;
+
+  ns = ns_since(&stats.lock_start);
+  stats.lock_hold = ns / 1e9;
+  DTRACE_PROBE1(passwd, lock__release, ns);
+}
+
+/* Return the number of nanoseconds elapsed on the monotonic clock
+ * since start.
+ */
+static long long ns_since(const struct timespec *start)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (ts.tv_sec - start->tv_sec) * 1000000000LL
+    + (ts.tv_nsec - start->tv_nsec);
+}
+
+/* Log the facts gathered about this run, and report them on stderr if
+ * -t was given.  status is the result of the run, 0 for success or -1
+ * for failure.
+ */
+static void log_stats(int status)
+{
+  char times[NPHASES * 32], *p = times;
+  int i;
+
+  *p = 0;
+  for (i = 0; i < NPHASES; i++)
+    {
+      sprintf(p, " %s=%.6f", phase_names[i], stats.phase_time[i]);
+      p += strlen(p);
+    }
+  syslog(LOG_DEBUG, "mode=%s outcome=%s status=%d users=%d found=%d "
+	 "passwd_size=%llu local_size=%llu lock_retries=%d lock_hold=%.6f "
+	 "conflicts=%d bytes_copied=%llu%s", stats.mode, stats.outcome,
+	 status, stats.nusers, stats.nfound,
+	 (unsigned long long) stats.passwd_size,
+	 (unsigned long long) stats.local_size, stats.lock_retries,
+	 stats.lock_hold, stats.conflicts,
+	 (unsigned long long) stats.bytes_copied, times);
+  if (stats.timing)
+    {
+      fprintf(stderr, "passwd: outcome: %s, timing:%s\n", stats.outcome,
+	      times);
+      fprintf(stderr, "passwd: lock retries: %d, lock held: %.6f, "
+	      "conflicts: %d, bytes copied: %llu\n", stats.lock_retries,
+	      stats.lock_hold, stats.conflicts,
+	      (unsigned long long) stats.bytes_copied);
     }
 }
 
 static void usage(void)
 {
-  fprintf(stderr, "Usage: passwd [-k|-l] [username]\n");
+  fprintf(stderr, "Usage: passwd [-t] [-k|-l] [username]\n");
+  fprintf(stderr, "       passwd [-t] -u [-r root ... [-j jobs]] "
+	  "[username ...]\n");
   exit(1);
 }
 
 static void cleanup(int sig)
 {
-  unlink(PATH_PASSWD_LOCAL_TMP);
+  remove_files();
   exit(1);
 }
+
+/* Handle SIGBUS from reading a mapped file which has been truncated.
+ * The fault may come in the middle of a stdio call, so use only
+ * async-signal-safe functions, and _exit() rather than exit().
+ */
+static void read_fault(int sig)
+{
+  static const char msg[] = "passwd: a passwd file shrank while being read "
+    "so not updating local passwd file.\n";
+  ssize_t nwritten;
+
+  (void) sig;
+
+  /* If we can't report the problem, we can still clean up. */
+  nwritten = write(STDERR_FILENO, msg, sizeof(msg) - 1);
+  (void) nwritten;
+  remove_files();
+  _exit(1);
+}
+
+/* Remove the new local passwd file and the lock file, if we have them.
+ * Called from signal handlers.
+ */
+static void remove_files(void)
+{
+  if (path_passwd_local_new)
+    unlink(path_passwd_local_new);
+  if (have_lock)
+    unlink(path_passwd_local_tmp);
+}
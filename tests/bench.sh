@@ -0,0 +1,108 @@
+#!/bin/sh
+# $Id$
+
+# Benchmark "passwd -u" against synthetic passwd files of increasing
+# size, with the user to be updated at the start, middle, and end of
+# the files.  Must be run as root.
+#
+# Usage: bench.sh passwd scratchdir
+#
+# The environment variables SIZES (default "1000 10000 100000
+# 1000000"), FORMAT (default shadow), and REPS (default 5) control the
+# runs.  For each size and position, the latency of the update (the
+# sum of the phase times reported by -t) is given as the median, 90th
+# percentile and maximum over the runs, along with the throughput at
+# the median in megabytes of local passwd file per second and the peak
+# resident set size in kilobytes, if GNU time is available to measure
+# it.
+
+if [ $# -ne 2 ]; then
+	echo "Usage: $0 passwd scratchdir" >&2
+	exit 1
+fi
+passwd=$1
+dir=$2
+srcdir=`dirname "$0"`
+sizes=${SIZES-"1000 10000 100000 1000000"}
+format=${FORMAT-shadow}
+reps=${REPS-5}
+
+if [ "`id -u`" != 0 ]; then
+	echo "$0: must be run as root." >&2
+	exit 1
+fi
+
+# Print the p'th percentile of the numbers in file, one per line.
+percentile() {
+	sort -n "$2" | awk -v p="$1" '{ v[NR] = $1 }
+		END { i = int(NR * p / 100 + 0.999); if (i < 1) i = 1; print v[i] }'
+}
+
+if /usr/bin/time -f %M -o /dev/null true 2>/dev/null; then
+	gnutime=yes
+else
+	gnutime=no
+fi
+
+mkdir -p "$dir" || exit 1
+root=$dir/root
+local=$root/etc/$format.local
+printf "%9s %-6s %10s %10s %10s %8s %8s\n" entries where p50 p90 max \
+	MB/s RSS
+status=0
+for size in $sizes; do
+	sh "$srcdir/genpasswd.sh" "$root" "$format" "$size" || exit 1
+	cp -p "$local" "$dir/local.orig" || exit 1
+	bytes=`wc -c < "$local"`
+	for where in start middle end; do
+		case $where in
+		start)	user=u0 ;;
+		middle)	user=u`expr $size / 2` ;;
+		end)	user=u`expr $size - 1` ;;
+		esac
+		: > "$dir/times"
+		: > "$dir/rss"
+		i=0
+		while [ $i -lt $reps ]; do
+			cp -p "$dir/local.orig" "$local" || exit 1
+			if [ $gnutime = yes ]; then
+				/usr/bin/time -f %M -o "$dir/rss.1" \
+					"$passwd" -t -u -r "$root" $user \
+					> /dev/null 2> "$dir/out"
+				rval=$?
+				cat "$dir/rss.1" >> "$dir/rss"
+			else
+				"$passwd" -t -u -r "$root" $user \
+					> /dev/null 2> "$dir/out"
+				rval=$?
+			fi
+			if [ $rval -ne 0 ] \
+			    || ! grep "outcome: updated," "$dir/out" > /dev/null; then
+				echo "$0: update of $user failed:" >&2
+				cat "$dir/out" >&2
+				status=1
+			fi
+			sed -n 's/^passwd: outcome: [^,]*, timing://p' "$dir/out" \
+				| tr ' ' '\n' \
+				| awk -F= 'NF == 2 { t += $2 } END { print t }' \
+				>> "$dir/times"
+			i=`expr $i + 1`
+		done
+		p50=`percentile 50 "$dir/times"`
+		p90=`percentile 90 "$dir/times"`
+		max=`percentile 100 "$dir/times"`
+		mbps=`awk -v b="$bytes" -v t="$p50" \
+			'BEGIN { if (t > 0) printf "%.1f", b / t / 1048576; else print "-" }'`
+		if [ $gnutime = yes ]; then
+			rss=`percentile 100 "$dir/rss"`
+		else
+			rss=-
+		fi
+		printf "%9s %-6s %10s %10s %10s %8s %8s\n" $size $where $p50 \
+			$p90 $max $mbps $rss
+	done
+done
+rm -rf "$root"
+rm -f "$dir/local.orig" "$dir/times" "$dir/rss" "$dir/rss.1" "$dir/out"
+rmdir "$dir"
+exit $status
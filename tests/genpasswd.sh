@@ -0,0 +1,63 @@
+#!/bin/sh
+# $Id$
+
+# Generate a synthetic passwd file and local passwd file under a
+# scratch root directory, for use with "passwd -u -r root".
+#
+# Usage: genpasswd.sh root format nentries
+#
+# format is master.passwd, shadow, or passwd.  Users are named u0
+# through u<nentries-1>.  Each user's password field is NEW<n> in the
+# passwd file and OLD<n> in the local passwd file, so a successful
+# update of user un turns OLD<n> into NEW<n> in the local file.  One
+# entry in a hundred has a 4000-character GECOS field (except in the
+# shadow format, which has none).
+
+if [ $# -ne 3 ]; then
+	echo "Usage: $0 root format nentries" >&2
+	exit 1
+fi
+root=$1
+format=$2
+nentries=$3
+
+case $format in
+master.passwd|shadow|passwd)
+	;;
+*)
+	echo "$0: unknown format $format" >&2
+	exit 1
+	;;
+esac
+
+rm -rf "$root"
+mkdir -p "$root/etc" || exit 1
+
+for which in NEW OLD; do
+	if [ $which = NEW ]; then
+		file=$root/etc/$format
+	else
+		file=$root/etc/$format.local
+	fi
+	awk -v n="$nentries" -v fmt="$format" -v pw="$which" 'BEGIN {
+		long = sprintf("%4000s", "");
+		gsub(/ /, "x", long);
+		for (i = 0; i < n; i++) {
+			gecos = (i % 100 == 99) ? long : "User " i;
+			if (fmt == "master.passwd")
+				printf "u%d:%s%d:%d:%d::0:0:%s:/home/u%d:/bin/sh\n",
+				    i, pw, i, i + 1000, i + 1000, gecos, i;
+			else if (fmt == "shadow")
+				printf "u%d:%s%d:15000:0:99999:7:::\n", i, pw, i;
+			else
+				printf "u%d:%s%d:%d:%d:%s:/home/u%d:/bin/sh\n",
+				    i, pw, i, i + 1000, i + 1000, gecos, i;
+		}
+	}' > "$file" || exit 1
+done
+
+if [ $format = passwd ]; then
+	chmod 644 "$root/etc/passwd" "$root/etc/passwd.local"
+else
+	chmod 600 "$root/etc/$format" "$root/etc/$format.local"
+fi
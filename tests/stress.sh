@@ -0,0 +1,133 @@
+#!/bin/sh
+# $Id$
+
+# Stress the local passwd file update with many concurrent updaters,
+# as after a forced password expiry.  Must be run as root.
+#
+# Usage: stress.sh passwd scratchdir
+#
+# NUSERS (default 200) runs of "passwd -u -r" are started at once,
+# each updating a different user in a synthetic local passwd file of
+# NENTRIES (default 200000) entries in format FORMAT (default shadow).
+# Afterwards, the updates per second, the distribution of time spent
+# waiting for the lock, and the number of lock failures are reported,
+# and every update is checked to have made it into the local passwd
+# file.  The exit status is non-zero if any run failed, any update was
+# lost, or any temporary file was left behind.
+
+if [ $# -ne 2 ]; then
+	echo "Usage: $0 passwd scratchdir" >&2
+	exit 1
+fi
+passwd=$1
+dir=$2
+srcdir=`dirname "$0"`
+nusers=${NUSERS-200}
+nentries=${NENTRIES-200000}
+format=${FORMAT-shadow}
+
+if [ "`id -u`" != 0 ]; then
+	echo "$0: must be run as root." >&2
+	exit 1
+fi
+
+# Print the current time in milliseconds, or in whole seconds (times
+# 1000) if date can't do better.
+now() {
+	t=`date +%s%N`
+	case $t in
+	*N)	expr `date +%s` \* 1000 ;;
+	*)	expr $t / 1000000 ;;
+	esac
+}
+
+# Print the p'th percentile of the numbers in file, one per line.
+percentile() {
+	sort -n "$2" | awk -v p="$1" '{ v[NR] = $1 }
+		END { i = int(NR * p / 100 + 0.999); if (i < 1) i = 1; print v[i] }'
+}
+
+mkdir -p "$dir" || exit 1
+root=$dir/root
+sh "$srcdir/genpasswd.sh" "$root" "$format" "$nentries" || exit 1
+rm -f "$dir"/out.* "$dir"/fail.*
+
+# Spread the users over the file.
+step=`expr $nentries / $nusers`
+if [ $step -lt 1 ]; then
+	step=1
+fi
+
+start=`now`
+i=0
+while [ $i -lt $nusers ]; do
+	n=`expr $i \* $step`
+	( "$passwd" -t -u -r "$root" u$n > "$dir/out.$i" 2>&1 \
+	    || echo u$n > "$dir/fail.$i" ) &
+	i=`expr $i + 1`
+done
+wait
+end=`now`
+
+status=0
+nfailed=`ls "$dir" | grep -c '^fail\.'`
+ntimeout=`cat "$dir"/out.* | grep -c '^Timed out waiting for lock'`
+nopen=`cat "$dir"/out.* | grep -c "^Can't open .* for writing"`
+
+# Check that each user's entry was updated, and nothing else.
+nlost=0
+i=0
+while [ $i -lt $nusers ]; do
+	n=`expr $i \* $step`
+	if ! grep "^u$n:NEW$n:" "$root/etc/$format.local" > /dev/null; then
+		nlost=`expr $nlost + 1`
+	fi
+	i=`expr $i + 1`
+done
+nnew=`grep -c '^u[0-9]*:NEW' "$root/etc/$format.local"`
+nlines=`wc -l < "$root/etc/$format.local"`
+leftover=`ls "$root/etc" | grep -v "^$format\$" | grep -v "^$format\.local\$"`
+
+sed -n 's/^passwd: outcome: .* lock=\([0-9.]*\) .*/\1/p' "$dir"/out.* \
+	> "$dir/lockwait"
+elapsed=`expr $end - $start`
+if [ $elapsed -lt 1 ]; then
+	elapsed=1
+fi
+
+echo "updaters: $nusers, entries: $nentries, format: $format"
+echo "elapsed: $elapsed ms," \
+	"updates per second: `expr $nusers \* 1000 / $elapsed`"
+echo "lock wait (s): p50 `percentile 50 "$dir/lockwait"`," \
+	"p90 `percentile 90 "$dir/lockwait"`," \
+	"p99 `percentile 99 "$dir/lockwait"`," \
+	"max `percentile 100 "$dir/lockwait"`"
+echo "lock retries: `cat "$dir"/out.* \
+	| sed -n 's/^passwd: lock retries: \([0-9]*\),.*/\1/p' \
+	| awk '{ t += $1 } END { print t + 0 }'`," \
+	"conflicts: `cat "$dir"/out.* \
+	| sed -n 's/.*conflicts: \([0-9]*\),.*/\1/p' \
+	| awk '{ t += $1 } END { print t + 0 }'`"
+echo "failed runs: $nfailed (lock timeouts: $ntimeout," \
+	"can't open lock: $nopen)"
+echo "lost updates: $nlost"
+
+if [ $nfailed -ne 0 ]; then
+	cat "$dir"/fail.* | sed 's/^/failed: /'
+	status=1
+fi
+if [ $nlost -ne 0 ] || [ $nnew -ne $nusers ] || [ $nlines -ne $nentries ]
+then
+	echo "$0: local passwd file has $nlines entries, $nnew updated;" \
+		"expected $nentries and $nusers." >&2
+	status=1
+fi
+if [ -n "$leftover" ]; then
+	echo "$0: files left behind:" $leftover >&2
+	status=1
+fi
+
+rm -rf "$root"
+rm -f "$dir"/out.* "$dir"/fail.* "$dir/lockwait"
+rmdir "$dir"
+exit $status